@@ -20,15 +20,31 @@
 // WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #include "blogstore.capnp.h"
+#include "shmstream.h"
+#include <algorithm>
 #include <capnp/ez-rpc.h>
+#include <capnp/rpc-twoparty.h>
 #include <chrono>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <kj/exception.h>
 #include <map>
+#include <numeric>
 #include <string>
+#include <vector>
 
 #define TEXT_LEN 4096
 #define BLOG_COUNT 1024
+#define CACHE_ROUNDS 4
+#define HOT_KEYS 4
+#define HOT_KEY_BASE (2 * BLOG_COUNT)
+#define UPDATE_WORKERS 16
+#define UPDATES_PER_WORKER 64
+#define UPDATE_TOKEN "<update>"
+#define UPDATE_TOKEN_LEN (sizeof(UPDATE_TOKEN) - 1)
+#define LOAD_KEYS 64
+#define LOAD_ROUNDS 16
 
 class Timer {
 public:
@@ -45,12 +61,49 @@ public:
             .count();
     }
 
+    double elapsedMicros() const {
+        return std::chrono::duration<double, std::micro>(clock_::now() - m_beg)
+            .count();
+    }
+
 private:
     typedef std::chrono::high_resolution_clock clock_;
     typedef std::chrono::duration<double, std::ratio<1>> second_;
     std::chrono::time_point<clock_> m_beg;
 };
 
+class LatencyStats {
+    // Collects per-operation latencies (in microseconds) and reports their
+    // distribution.
+
+public:
+    void record(double micros) {
+        samples.push_back(micros);
+    }
+
+    void report(const std::string& name) {
+        if (samples.empty()) {
+            return;
+        }
+        std::sort(samples.begin(), samples.end());
+        double sum = std::accumulate(samples.begin(), samples.end(), 0.0);
+
+        std::cout << "  " << name << ": avg " << sum / samples.size()
+                  << "us, p50 " << percentile(0.50)
+                  << "us, p90 " << percentile(0.90)
+                  << "us, p99 " << percentile(0.99)
+                  << "us, max " << samples.back() << "us." << std::endl;
+    }
+
+private:
+    double percentile(double p) const {
+        size_t index = static_cast<size_t>(p * samples.size());
+        return samples[std::min(index, samples.size() - 1)];
+    }
+
+    std::vector<double> samples;
+};
+
 std::string generateRandomText() {
     std::string text("");
     for (int i = 0; i < TEXT_LEN; i++) {
@@ -128,26 +181,241 @@ void remoteCopy(BlogStore::Client& blogStore,
     storePromise.wait(waitScope);
 }
 
-int main(int argc, const char* argv[]) {
-    if (argc != 2) {
-        std::cerr << "usage: " << argv[0] << " HOST:PORT\n"
-                  << std::endl;
-        return 1;
+// Removes the blog only if its version is `expectedVersion`.  Either way,
+// `currentVersion` receives the version the server saw.
+bool remoteRemoveIf(BlogStore::Client& blogStore,
+                    kj::WaitScope& waitScope,
+                    uint64_t key,
+                    uint64_t expectedVersion,
+                    uint64_t& currentVersion) {
+    // Set up the request.
+    auto request = blogStore.removeIfRequest();
+    request.setKey(key);
+    request.setExpectedVersion(expectedVersion);
+
+    auto response = request.send().wait(waitScope);
+
+    currentVersion = response.getVersion();
+    return response.getRemoved();
+}
+
+uint64_t randomHotKey() {
+    return HOT_KEY_BASE + rand() % HOT_KEYS;
+}
+
+// Each of the update workers below appends UPDATE_TOKEN to a random hot blog
+// `remaining` times, counting the attempts it has to redo in `retries`.
+typedef kj::Promise<void> (*UpdateWorker)(BlogStore::Client blogStore, uint64_t* retries, int remaining);
+
+// Read-modify-write from the client: concurrent updates of the same blog
+// overwrite each other, so some of them are lost.
+kj::Promise<void> getThenStoreUpdates(BlogStore::Client blogStore, uint64_t* retries, int remaining) {
+    if (remaining == 0) {
+        return kj::READY_NOW;
     }
+    uint64_t key = randomHotKey();
 
-    srand(time(NULL));
-    capnp::EzRpcClient client(argv[1]);
-    BlogStore::Client blogStore = client.getMain<BlogStore>();
+    auto getRequest = blogStore.getRequest();
+    getRequest.setKey(key);
+    auto readPromise = getRequest.send().getBlog().readRequest().send();
+
+    return readPromise.then([blogStore, retries, key, remaining](capnp::Response<BlogStore::Blog::ReadResults> response) mutable {
+        std::string blog = response.getBlog();
+        blog += UPDATE_TOKEN;
+
+        auto storeRequest = blogStore.storeRequest();
+        storeRequest.setKey(key);
+        storeRequest.getBlog().setBlog(blog);
+
+        return storeRequest.send().then([blogStore, retries, remaining](capnp::Response<BlogStore::StoreResults>) mutable {
+            return getThenStoreUpdates(blogStore, retries, remaining - 1);
+        });
+    });
+}
+
+// Read-modify-write guarded by the version: retried until no other update
+// slipped in between the read and the swap.
+kj::Promise<void> compareAndSwapUpdate(BlogStore::Client blogStore, uint64_t* retries, uint64_t key) {
+    auto getRequest = blogStore.getRequest();
+    getRequest.setKey(key);
+    auto readPromise = getRequest.send().getBlog().readRequest().send();
+
+    return readPromise.then([blogStore, retries, key](capnp::Response<BlogStore::Blog::ReadResults> response) mutable {
+        std::string blog = response.getBlog();
+        blog += UPDATE_TOKEN;
 
+        auto casRequest = blogStore.compareAndSwapRequest();
+        casRequest.setKey(key);
+        casRequest.setExpectedVersion(response.getVersion());
+        casRequest.setBlog(blog);
+
+        return casRequest.send().then([blogStore, retries, key](capnp::Response<BlogStore::CompareAndSwapResults> response) mutable -> kj::Promise<void> {
+            if (response.getSwapped()) {
+                return kj::READY_NOW;
+            }
+            ++*retries;
+            return compareAndSwapUpdate(blogStore, retries, key);
+        });
+    });
+}
+
+kj::Promise<void> compareAndSwapUpdates(BlogStore::Client blogStore, uint64_t* retries, int remaining) {
+    if (remaining == 0) {
+        return kj::READY_NOW;
+    }
+
+    return compareAndSwapUpdate(blogStore, retries, randomHotKey()).then([blogStore, retries, remaining]() mutable {
+        return compareAndSwapUpdates(blogStore, retries, remaining - 1);
+    });
+}
+
+// The update runs inside the server in a single call, and only the token
+// crosses the wire.
+kj::Promise<void> appendUpdates(BlogStore::Client blogStore, uint64_t* retries, int remaining) {
+    if (remaining == 0) {
+        return kj::READY_NOW;
+    }
+
+    auto request = blogStore.appendRequest();
+    request.setKey(randomHotKey());
+    request.setText(UPDATE_TOKEN);
+
+    return request.send().then([blogStore, retries, remaining](capnp::Response<BlogStore::AppendResults>) mutable {
+        return appendUpdates(blogStore, retries, remaining - 1);
+    });
+}
+
+// Runs UPDATE_WORKERS concurrent workers against the hot blogs and reports the
+// update throughput, together with the number of updates that were lost.  Exits
+// if any was lost by a pattern that is meant to keep them all.
+void benchmarkUpdates(const std::string& name,
+                      BlogStore::Client& blogStore,
+                      kj::WaitScope& waitScope,
+                      UpdateWorker worker,
+                      bool mayLoseUpdates) {
+    std::string initial = generateRandomText();
+    for (int i = 0; i < HOT_KEYS; i++) {
+        remoteStore(blogStore, waitScope, HOT_KEY_BASE + i, initial);
+    }
+
+    uint64_t retries = 0;
     Timer timer;
 
-    // Keep an eye on `waitScope`.  Whenever you see it used is a place where we
-    // stop and wait for the server to respond.  If a line of code does not use
-    // `waitScope`, then it does not block!
-    auto& waitScope = client.getWaitScope();
+    auto workers = kj::heapArrayBuilder<kj::Promise<void>>(UPDATE_WORKERS);
+    for (int i = 0; i < UPDATE_WORKERS; i++) {
+        workers.add(worker(blogStore, &retries, UPDATES_PER_WORKER));
+    }
+    kj::joinPromises(workers.finish()).wait(waitScope);
+
+    double elapsed = timer.elapsedMicros();
+
+    // Every applied update has left exactly one token behind.
+    uint64_t applied = 0;
+    for (int i = 0; i < HOT_KEYS; i++) {
+        applied += (remoteGet(blogStore, waitScope, HOT_KEY_BASE + i).size() - TEXT_LEN) / UPDATE_TOKEN_LEN;
+    }
+    uint64_t total = UPDATE_WORKERS * UPDATES_PER_WORKER;
+
+    std::cout << "  " << name << ": " << total * 1000000.0 / elapsed
+              << " updates/s, " << total - applied << " of " << total
+              << " updates lost, " << retries << " retries." << std::endl;
+
+    if (applied != total && !mayLoseUpdates) {
+        std::cerr << "Updates were lost!!!" << std::endl;
+        std::exit(1);
+    }
+}
+
+class BlogCache {
+    // Client-side cache of blog texts.  Misses are fetched through a watcher,
+    // which asks the server to push an invalidate() to our listener on the next
+    // store or remove of that key, so hits never need a round trip.  The server
+    // only keeps that promise for BlogStore::LEASE_MILLIS after each fetch, so
+    // entries expire by then, counted from when the fetch was sent.
+
+public:
+    BlogCache(BlogStore::Client& blogStore)
+        : listener(kj::heap<ListenerImpl>(*this)), watcher(nullptr) {
+        auto request = blogStore.watchRequest();
+        request.setListener(listener);
+        watcher = request.send().getWatcher();
+    }
+
+    // The get may throw exception when the key is not existing.
+    std::string get(kj::WaitScope& waitScope, uint64_t key) {
+        auto now = std::chrono::steady_clock::now();
+        auto find = entries.find(key);
+        if (find != entries.end() && now < find->second.expiry) {
+            hits++;
+            return find->second.blog;
+        }
+        misses++;
+
+        auto request = watcher.getRequest();
+        request.setKey(key);
+
+        uint64_t invalidationsBefore = invalidations;
+        auto response = request.send().wait(waitScope);
+        std::string blog = response.getBlog();
+
+        // An invalidation delivered while we were waiting may be for this very
+        // key, in which case the text we hold is already stale.
+        if (invalidations == invalidationsBefore) {
+            entries[key] = Entry{blog, now + std::chrono::milliseconds(BlogStore::LEASE_MILLIS)};
+        }
+        return blog;
+    }
+
+    double hitRate() const {
+        uint64_t total = hits + misses;
+        return total == 0 ? 0.0 : 100.0 * hits / total;
+    }
+
+private:
+    class ListenerImpl final : public BlogStore::Listener::Server {
+        // Receives the invalidations pushed by the server.
+
+    public:
+        ListenerImpl(BlogCache& cache)
+            : cache(cache) {}
+
+        kj::Promise<void> invalidate(InvalidateContext context) override {
+            cache.entries.erase(context.getParams().getKey());
+            cache.invalidations++;
+            return kj::READY_NOW;
+        }
+
+    private:
+        BlogCache& cache;
+    };
+
+    struct Entry {
+        std::string blog;
+        std::chrono::steady_clock::time_point expiry;
+    };
+
+    BlogStore::Listener::Client listener;
+    BlogStore::Watcher::Client watcher;
+    std::map<uint64_t, Entry> entries;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t invalidations = 0;
+};
+
+// Runs all the operations against the store, whatever the transport.
+//
+// Keep an eye on `waitScope`.  Whenever you see it used is a place where we
+// stop and wait for the server to respond.  If a line of code does not use
+// `waitScope`, then it does not block!
+void runBenchmarks(BlogStore::Client& blogStore, kj::WaitScope& waitScope) {
+    Timer timer;
 
     std::map<uint64_t, std::string> localBlogs;
 
+    // Lives as long as the connection, since the server pushes invalidations
+    // for every key it has handed out while their leases last.
+    BlogCache cache(blogStore);
+
     // Generate random text.
     {
         for (int i = 0; i < BLOG_COUNT; i++) {
@@ -189,6 +457,54 @@ int main(int argc, const char* argv[]) {
         std::cout << "Done and success! Time costed: " << elapsed << "ms." << std::endl;
     }
 
+    // Read all the blogs several times, with and without the client-side cache
+    {
+        std::cout << "Read all the " << BLOG_COUNT << " blogs " << CACHE_ROUNDS
+                  << " times, with and without the cache..." << std::endl;
+
+        LatencyStats uncachedStats;
+        LatencyStats cachedStats;
+
+        // All the rounds of a key run back to back, so that its cached copy is
+        // still within its lease when it is read again.
+        for (int i = 0; i < BLOG_COUNT; i++) {
+            for (int round = 0; round < CACHE_ROUNDS; round++) {
+                try {
+                    timer.reset();
+                    auto blog = remoteGet(blogStore, waitScope, i);
+                    uncachedStats.record(timer.elapsedMicros());
+
+                    timer.reset();
+                    auto cachedBlog = cache.get(waitScope, i);
+                    cachedStats.record(timer.elapsedMicros());
+
+                    if (blog != localBlogs[i] || cachedBlog != localBlogs[i]) {
+                        std::cerr << "The result of Get is wrong!!!" << std::endl;
+                        std::exit(1);
+                    }
+                } catch (kj::Exception const& e) {
+                    std::cerr << e.getDescription().cStr() << std::endl;
+                }
+            }
+        }
+
+        uncachedStats.report("Without cache");
+        cachedStats.report("With cache");
+        std::cout << "  Cache hit rate: " << cache.hitRate() << "%." << std::endl;
+
+        // Overwrite a cached blog; the server must invalidate our copy before
+        // the store returns.  Read it first so that its lease is fresh.
+        std::cout << "Check the cache after overwriting a blog (key == 0)... ";
+        cache.get(waitScope, 0);
+        localBlogs[0] = generateRandomText();
+        remoteStore(blogStore, waitScope, 0, localBlogs[0]);
+        if (cache.get(waitScope, 0) != localBlogs[0]) {
+            std::cerr << "The cache returned a stale blog!!!" << std::endl;
+            std::exit(1);
+        }
+        std::cout << "Done and success!" << std::endl;
+    }
+
     // Try to get a non-existing blog, and expect to catch an exception
     {
         std::cout << "Test for getting a non-existing blog (key == "
@@ -235,6 +551,32 @@ int main(int argc, const char* argv[]) {
         std::cout << "Done and success!" << std::endl;
     }
 
+    // Update a few hot blogs concurrently, with each of the update patterns
+    {
+        std::cout << "Update " << HOT_KEYS << " hot blogs with " << UPDATE_WORKERS
+                  << " concurrent workers, " << UPDATES_PER_WORKER
+                  << " updates each..." << std::endl;
+
+        benchmarkUpdates("Get then store", blogStore, waitScope, getThenStoreUpdates, true);
+        benchmarkUpdates("Compare and swap", blogStore, waitScope, compareAndSwapUpdates, false);
+        benchmarkUpdates("Append", blogStore, waitScope, appendUpdates, false);
+
+        std::cout << "Remove the hot blogs conditionally... ";
+
+        for (int i = 0; i < HOT_KEYS; i++) {
+            uint64_t version = 0;
+
+            // Version 0 never matches an existing blog, so this must fail and
+            // tell us the current version instead.
+            if (remoteRemoveIf(blogStore, waitScope, HOT_KEY_BASE + i, 0, version) ||
+                !remoteRemoveIf(blogStore, waitScope, HOT_KEY_BASE + i, version, version)) {
+                std::cerr << "The result of RemoveIf is wrong!!!" << std::endl;
+                std::exit(1);
+            }
+        }
+        std::cout << "Done and success!" << std::endl;
+    }
+
     // Remove all the blogs
     {
         std::cout << "Remove all the " << 2 * BLOG_COUNT << " blogs...";
@@ -261,5 +603,132 @@ int main(int argc, const char* argv[]) {
             std::cerr << e.getDescription().cStr() << std::endl;
         }
     }
+}
+
+// Issues `remaining` gets one after another on a single connection, recording
+// the latency of each.
+kj::Promise<void> loadGets(BlogStore::Client blogStore, LatencyStats* stats, int remaining) {
+    if (remaining == 0) {
+        return kj::READY_NOW;
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+
+    auto getRequest = blogStore.getRequest();
+    getRequest.setKey(rand() % LOAD_KEYS);
+    auto readPromise = getRequest.send().getBlog().readRequest().send();
+
+    return readPromise.then([blogStore, stats, remaining, start](capnp::Response<BlogStore::Blog::ReadResults>) mutable {
+        stats->record(std::chrono::duration<double, std::micro>(
+                          std::chrono::high_resolution_clock::now() - start)
+                          .count());
+        return loadGets(blogStore, stats, remaining - 1);
+    });
+}
+
+// Keeps one get in flight on each of the connections in `blogStores` until
+// all have done LOAD_ROUNDS gets.  The connections must all be driven by the
+// event loop of `waitScope`.
+void runLoad(std::vector<BlogStore::Client>& blogStores, kj::WaitScope& waitScope) {
+    size_t connections = blogStores.size();
+
+    std::string blog = generateRandomText();
+    for (int i = 0; i < LOAD_KEYS; i++) {
+        remoteStore(blogStores.front(), waitScope, i, blog);
+    }
+
+    // Do one get on every connection first, so that connection setup is not
+    // part of the measurement.
+    {
+        std::cout << "Connect " << connections << " clients... ";
+        LatencyStats stats;
+        auto gets = kj::heapArrayBuilder<kj::Promise<void>>(connections);
+        for (auto& blogStore : blogStores) {
+            gets.add(loadGets(blogStore, &stats, 1));
+        }
+        kj::joinPromises(gets.finish()).wait(waitScope);
+        std::cout << "Done and success!" << std::endl;
+    }
+
+    {
+        std::cout << "Get " << LOAD_ROUNDS << " blogs on each of the "
+                  << connections << " connections..." << std::endl;
+        LatencyStats stats;
+        Timer timer;
+
+        auto gets = kj::heapArrayBuilder<kj::Promise<void>>(connections);
+        for (auto& blogStore : blogStores) {
+            gets.add(loadGets(blogStore, &stats, LOAD_ROUNDS));
+        }
+        kj::joinPromises(gets.finish()).wait(waitScope);
+
+        double elapsed = timer.elapsedMicros();
+        std::cout << "  Throughput: " << connections * LOAD_ROUNDS * 1000000.0 / elapsed
+                  << " gets/s." << std::endl;
+        stats.report("Get");
+    }
+
+    for (int i = 0; i < LOAD_KEYS; i++) {
+        remoteRemove(blogStores.front(), waitScope, i);
+    }
+}
+
+int main(int argc, const char* argv[]) {
+    if (argc != 2 && argc != 3) {
+        std::cerr << "usage: " << argv[0] << " HOST:PORT\n"
+                  << "       " << argv[0] << " " SHM_PREFIX "/path/to/socket\n"
+                  << "       " << argv[0] << " HOST:PORT CONNECTIONS\n"
+                  << "       " << argv[0] << " " SHM_PREFIX "/path/to/socket CONNECTIONS\n"
+                  << "The last two forms only measure gets, with one in flight on\n"
+                  << "each of CONNECTIONS connections at a time.\n"
+                  << std::endl;
+        return 1;
+    }
+
+    srand(time(NULL));
+
+    // Zero runs all the benchmarks on a single connection instead.
+    int connections = 0;
+    if (argc == 3) {
+        connections = atoi(argv[2]);
+        if (connections <= 0) {
+            std::cerr << "CONNECTIONS must be a positive number." << std::endl;
+            return 1;
+        }
+    }
+
+    if (strncmp(argv[1], SHM_PREFIX, strlen(SHM_PREFIX)) == 0) {
+        // Same-host server: talk through shared memory instead of a socket.
+        auto io = kj::setupAsyncIo();
+        std::vector<kj::Own<kj::AsyncIoStream>> streams;
+        std::vector<kj::Own<capnp::TwoPartyClient>> clients;
+        std::vector<BlogStore::Client> blogStores;
+        for (int i = 0; i < std::max(connections, 1); i++) {
+            streams.push_back(connectShm(io.unixEventPort, argv[1] + strlen(SHM_PREFIX)));
+            clients.push_back(kj::heap<capnp::TwoPartyClient>(*streams.back()));
+            blogStores.push_back(clients.back()->bootstrap().castAs<BlogStore>());
+        }
+
+        if (connections > 0) {
+            runLoad(blogStores, io.waitScope);
+        } else {
+            runBenchmarks(blogStores.front(), io.waitScope);
+        }
+    } else {
+        std::vector<kj::Own<capnp::EzRpcClient>> clients;
+        std::vector<BlogStore::Client> blogStores;
+        for (int i = 0; i < std::max(connections, 1); i++) {
+            clients.push_back(kj::heap<capnp::EzRpcClient>(argv[1]));
+            blogStores.push_back(clients.back()->getMain<BlogStore>());
+        }
+
+        // All the clients of a thread share the same event loop.
+        auto& waitScope = clients.front()->getWaitScope();
+        if (connections > 0) {
+            runLoad(blogStores, waitScope);
+        } else {
+            runBenchmarks(blogStores.front(), waitScope);
+        }
+    }
     return 0;
 }
@@ -20,11 +20,19 @@
 // WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #include "blogstore.capnp.h"
+#include "shmstream.h"
+#include "uringio.h"
 #include <capnp/ez-rpc.h>
 #include <capnp/message.h>
+#include <capnp/rpc-twoparty.h>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <kj/debug.h>
+#include <kj/timer.h>
+#include <kj/vector.h>
 #include <map>
+#include <set>
 
 kj::Promise<capnp::Text::Reader> readBlog(BlogStore::Blog::Client blog) {
     // Helper function to asynchronously call read() on a BlogStore::Blog and
@@ -40,16 +48,54 @@ class BlogImpl final : public BlogStore::Blog::Server {
     // Simple implementation of the Calculator.Value Cap'n Proto interface.
 
 public:
-    BlogImpl(std::string blog)
-        : blog(blog) {}
+    BlogImpl(std::string blog, uint64_t version)
+        : blog(blog), version(version) {}
 
     kj::Promise<void> read(ReadContext context) {
-        context.getResults().setBlog(blog);
+        auto results = context.getResults();
+        results.setBlog(blog);
+        results.setVersion(version);
         return kj::READY_NOW;
     }
 
 private:
     std::string blog;
+    uint64_t version;
+};
+
+class BlogStoreImpl;
+
+class WatcherImpl final : public BlogStore::Watcher::Server {
+    // One client's registration for invalidations.  It is destroyed once the
+    // client drops it or disconnects, which unregisters it from every key.
+
+public:
+    WatcherImpl(BlogStoreImpl& store, BlogStore::Listener::Client listener)
+        : store(store), listener(listener) {}
+
+    ~WatcherImpl();
+
+    kj::Promise<void> get(GetContext context) override;
+
+    // Stops watching `key`, and returns when the lease of the client's copy
+    // runs out.
+    kj::TimePoint endLease(uint64_t key) {
+        auto find = leases.find(key);
+        kj::TimePoint lease = find->second;
+        leases.erase(find);
+        return lease;
+    }
+
+    BlogStore::Listener::Client getListener() {
+        return listener;
+    }
+
+private:
+    BlogStoreImpl& store;
+    BlogStore::Listener::Client listener;
+
+    // End of the lease of every key watched.
+    std::map<uint64_t, kj::TimePoint> leases;
 };
 
 class BlogStoreImpl final : public BlogStore::Server {
@@ -64,7 +110,7 @@ public:
         if (find == storage.end()) {
             KJ_FAIL_REQUIRE("blog entry for " + std::to_string(key) + " not found!");
         } else {
-            context.getResults().setBlog(kj::heap<BlogImpl>(find->second));
+            context.getResults().setBlog(kj::heap<BlogImpl>(find->second.blog, find->second.version));
             return kj::READY_NOW;
         }
     }
@@ -77,12 +123,13 @@ public:
         switch (blog.which()) {
 
         case BlogStore::Store::BLOG:
-            storage[key] = blog.getBlog();
-            return kj::READY_NOW;
+            context.getResults().setVersion(put(key, blog.getBlog()));
+            return invalidate(key);
 
         case BlogStore::Store::PREVIOUS_GET:
             return readBlog(blog.getPreviousGet()).then([ KJ_CPCAP(context), this, key ](kj::StringPtr blog) mutable {
-                storage[key] = blog;
+                context.getResults().setVersion(put(key, blog));
+                return invalidate(key);
             });
         default:
             KJ_FAIL_REQUIRE("Unknown data type.");
@@ -98,33 +145,166 @@ public:
             KJ_FAIL_REQUIRE("blog entry for " + std::to_string(key) + " not found!");
         } else {
             storage.erase(key);
+            return invalidate(key);
+        }
+    }
+
+    kj::Promise<void> watch(WatchContext context) override {
+        context.getResults().setWatcher(kj::heap<WatcherImpl>(*this, context.getParams().getListener()));
+        return kj::READY_NOW;
+    }
+
+    kj::Promise<void> append(AppendContext context) override {
+        auto params = context.getParams();
+        auto key = params.getKey();
+
+        // Missing keys start out as an empty blog.
+        auto& entry = storage[key];
+        entry.blog += params.getText().cStr();
+        entry.version = nextVersion++;
+
+        context.getResults().setVersion(entry.version);
+        return invalidate(key);
+    }
+
+    kj::Promise<void> compareAndSwap(CompareAndSwapContext context) override {
+        auto params = context.getParams();
+        auto key = params.getKey();
+        auto results = context.getResults();
+
+        uint64_t current = currentVersion(key);
+
+        if (current != params.getExpectedVersion()) {
+            results.setSwapped(false);
+            results.setVersion(current);
             return kj::READY_NOW;
+        } else {
+            results.setSwapped(true);
+            results.setVersion(put(key, params.getBlog()));
+            return invalidate(key);
         }
     }
 
-    BlogStoreImpl() = default;
+    kj::Promise<void> removeIf(RemoveIfContext context) override {
+        auto params = context.getParams();
+        auto key = params.getKey();
+        auto results = context.getResults();
+
+        uint64_t current = currentVersion(key);
+
+        if (current == 0 || current != params.getExpectedVersion()) {
+            results.setRemoved(false);
+            results.setVersion(current);
+            return kj::READY_NOW;
+        } else {
+            storage.erase(key);
+            results.setRemoved(true);
+            return invalidate(key);
+        }
+    }
+
+    BlogStoreImpl(kj::Timer& timer)
+        : timer(timer) {}
 
 private:
-    std::map<uint64_t, std::string> storage;
+    friend class WatcherImpl;
+
+    struct Entry {
+        std::string blog;
+        uint64_t version = 0;
+    };
+
+    uint64_t put(uint64_t key, kj::StringPtr blog) {
+        // Stores the blog under a fresh version and returns that version.
+        auto& entry = storage[key];
+        entry.blog = blog;
+        entry.version = nextVersion++;
+        return entry.version;
+    }
+
+    uint64_t currentVersion(uint64_t key) const {
+        auto find = storage.find(key);
+        return find == storage.end() ? 0 : find->second.version;
+    }
+
+    kj::Promise<void> invalidate(uint64_t key) {
+        // Tell every client caching `key` to drop it.  The write completes once
+        // each of them has either acknowledged or seen the lease of its copy run
+        // out, so a client never serves a stale value from its cache after the
+        // write has returned, yet cannot hold up writes for longer than a lease.
+        auto find = watchers.find(key);
+
+        if (find == watchers.end()) {
+            return kj::READY_NOW;
+        }
+
+        auto watching = kj::mv(find->second);
+        watchers.erase(find);
+
+        auto now = timer.now();
+        kj::Vector<kj::Promise<void>> promises;
+        for (auto watcher : watching) {
+            kj::TimePoint lease = watcher->endLease(key);
+            if (lease <= now) {
+                // The client no longer serves its copy anyway.
+                continue;
+            }
+
+            auto request = watcher->getListener().invalidateRequest();
+            request.setKey(key);
+            promises.add(request.send().then([](capnp::Response<BlogStore::Listener::InvalidateResults>) {},
+                                             [](kj::Exception&&) {
+                                                 // The client has gone away, so there is no cache left to invalidate.
+                                             })
+                             .exclusiveJoin(timer.atTime(lease)));
+        }
+        return kj::joinPromises(promises.releaseAsArray());
+    }
+
+    kj::Timer& timer;
+
+    std::map<uint64_t, Entry> storage;
+
+    // Versions are drawn from a single counter, so that a key that is removed
+    // and stored again never repeats a version a client may still hold.
+    uint64_t nextVersion = 1;
+
+    // Watchers to notify on the next write of each key.
+    std::map<uint64_t, std::set<WatcherImpl*>> watchers;
 };
 
-int main(int argc, const char* argv[]) {
-    if (argc != 2) {
-        std::cerr << "usage: " << argv[0]
-                  << " ADDRESS[:PORT]\n"
-                     "Runs the server bound to the given address/port.\n"
-                     "ADDRESS may be '*' to bind to all local addresses.\n"
-                     ":PORT may be omitted to choose a port automatically."
-                  << std::endl;
-        return 1;
+WatcherImpl::~WatcherImpl() {
+    for (auto& lease : leases) {
+        auto find = store.watchers.find(lease.first);
+        find->second.erase(this);
+        if (find->second.empty()) {
+            store.watchers.erase(find);
+        }
     }
+}
 
-    // Set up a server.
-    capnp::EzRpcServer server(kj::heap<BlogStoreImpl>(), argv[1], 1234);
+kj::Promise<void> WatcherImpl::get(GetContext context) {
+    auto key = context.getParams().getKey();
 
+    auto find = store.storage.find(key);
+
+    if (find == store.storage.end()) {
+        KJ_FAIL_REQUIRE("blog entry for " + std::to_string(key) + " not found!");
+    } else {
+        // We are past the moment the client sent its request, which is when
+        // its own lease started, so ours never ends before the client's does.
+        leases[key] = store.timer.now() + static_cast<int64_t>(BlogStore::LEASE_MILLIS) * kj::MILLISECONDS;
+        store.watchers[key].insert(this);
+
+        auto results = context.getResults();
+        results.setBlog(find->second.blog);
+        results.setVersion(find->second.version);
+        return kj::READY_NOW;
+    }
+}
+
+void reportListening(uint port) {
     // Write the port number to stdout, in case it was chosen automatically.
-    auto& waitScope = server.getWaitScope();
-    uint port = server.getPort().wait(waitScope);
     if (port == 0) {
         // The address format "unix:/path/to/socket" opens a unix domain socket,
         // in which case the port will be zero.
@@ -132,6 +312,92 @@ int main(int argc, const char* argv[]) {
     } else {
         std::cout << "Listening on port " << port << "..." << std::endl;
     }
+}
+
+int main(int argc, const char* argv[]) {
+    // --io-uring may be followed by =BUFFERS, the number of receive buffers.
+    bool useIoUring = argc == 3 && strncmp(argv[1], "--io-uring", strlen("--io-uring")) == 0;
+    unsigned receiveBuffers = DEFAULT_URING_RECEIVE_BUFFERS;
+    if (useIoUring) {
+        const char* option = argv[1] + strlen("--io-uring");
+        if (*option == '=') {
+            receiveBuffers = atoi(option + 1);
+        } else if (*option != '\0') {
+            useIoUring = false;
+        }
+    }
+
+    // A lone option would otherwise be taken for the address.
+    if ((argc != 2 && !useIoUring) || (argc == 2 && argv[1][0] == '-')) {
+        std::cerr << "usage: " << argv[0]
+                  << " [--io-uring[=BUFFERS]] ADDRESS[:PORT]\n"
+                     "Runs the server bound to the given address/port.\n"
+                     "ADDRESS may be '*' to bind to all local addresses.\n"
+                     ":PORT may be omitted to choose a port automatically.\n"
+                     "ADDRESS may also be '" SHM_PREFIX "/path/to/socket' to serve clients\n"
+                     "on the same host through shared memory.\n"
+                     "--io-uring serves the network through io_uring instead of epoll,\n"
+                     "with BUFFERS 4 KiB receive buffers shared by all connections."
+                  << std::endl;
+        return 1;
+    }
+
+    const char* address = argv[argc - 1];
+
+    if (useIoUring) {
+        if (!uringAvailable()) {
+            std::cerr << "--io-uring is not built in; rebuild with `make USE_IO_URING=1`." << std::endl;
+            return 1;
+        }
+        if (strncmp(address, SHM_PREFIX, strlen(SHM_PREFIX)) == 0) {
+            std::cerr << "--io-uring only serves the network; it cannot be combined with a "
+                      << SHM_PREFIX << " address." << std::endl;
+            return 1;
+        }
+        if (receiveBuffers == 0 || receiveBuffers > MAX_URING_RECEIVE_BUFFERS
+            || (receiveBuffers & (receiveBuffers - 1)) != 0) {
+            std::cerr << "BUFFERS must be a power of two no larger than "
+                      << MAX_URING_RECEIVE_BUFFERS << "." << std::endl;
+            return 1;
+        }
+
+        // Drive the event loop with io_uring; the RPC system is set up by hand
+        // since EzRpcServer always uses kj's epoll-based event port.
+        auto port = newUringEventPort(receiveBuffers);
+        kj::EventLoop loop(*port);
+        kj::WaitScope waitScope(loop);
+
+        capnp::TwoPartyServer server(kj::heap<BlogStoreImpl>(getUringTimer(*port)));
+        auto listener = listenUring(*port, address, 1234);
+        reportListening(listener->getPort());
+
+        // Run forever, accepting connections and handling requests.
+        server.listen(*listener).wait(waitScope);
+        return 0;
+    }
+
+    if (strncmp(address, SHM_PREFIX, strlen(SHM_PREFIX)) == 0) {
+        // EzRpcServer only speaks over sockets, so set up the event loop and
+        // the RPC system by hand around the shared-memory streams.
+        auto io = kj::setupAsyncIo();
+        capnp::TwoPartyServer server(kj::heap<BlogStoreImpl>(io.provider->getTimer()));
+        auto listener = listenShm(io.unixEventPort, address + strlen(SHM_PREFIX));
+
+        std::cout << "Listening on shared memory..." << std::endl;
+
+        // Run forever, accepting connections and handling requests.
+        server.listen(*listener).wait(io.waitScope);
+        return 0;
+    }
+
+    // Set up a server.  The store needs the timer of the server's event loop,
+    // so it is handed over only once the server exists.
+    auto mainInterface = kj::newPromiseAndFulfiller<BlogStore::Client>();
+    capnp::EzRpcServer server(kj::mv(mainInterface.promise), address, 1234);
+    mainInterface.fulfiller->fulfill(kj::heap<BlogStoreImpl>(server.getIoProvider().getTimer()));
+
+    auto& waitScope = server.getWaitScope();
+    reportListening(server.getPort().wait(waitScope));
 
     // Run forever, accepting connections and handling requests.
     kj::NEVER_DONE.wait(waitScope);
@@ -0,0 +1,562 @@
+// Copyright (c) 2018 Pengfei Zhang <zpfalpc23@gmail.com>
+
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the
+// "Software"), to deal in the Software without restriction, including
+// without limitation the rights to use, copy, modify, merge, publish,
+// distribute, sublicense, and/or sell copies of the Software, and to
+// permit persons to whom the Software is furnished to do so, subject to
+// the following conditions:
+
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+// LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+// OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+// WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#include "shmstream.h"
+#include <kj/debug.h>
+
+#ifdef __linux__
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <errno.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+
+// Capacity of each ring, which must be a power of two.
+const size_t RING_SIZE = 1 << 20;
+
+// How long a client polls an empty ring before going to sleep on its doorbell.
+// Replies usually arrive within a few microseconds, and catching them here
+// saves the eventfd write, the epoll wakeup and the eventfd read.  The server
+// never spins, as it has other connections to serve.
+const std::chrono::microseconds SPIN_TIME(50);
+
+// Polls made in one turn of the event loop while spinning, before letting the
+// other events queued on the loop run.
+const int SPIN_POLLS_PER_TURN = 64;
+
+static_assert((RING_SIZE & (RING_SIZE - 1)) == 0, "RING_SIZE must be a power of two");
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "the rings need lock-free 64-bit atomics");
+
+struct Ring {
+    // A single-producer, single-consumer byte ring.  `head` and `tail` grow
+    // forever and are reduced modulo RING_SIZE on access.
+
+    alignas(64) std::atomic<uint64_t> head; // Advanced by the reader.
+    alignas(64) std::atomic<uint64_t> tail; // Advanced by the writer.
+
+    // Set by a side that is about to sleep on its doorbell; whoever clears it
+    // must ring that doorbell.
+    alignas(64) std::atomic<uint32_t> readerWaiting;
+    std::atomic<uint32_t> writerWaiting;
+
+    // Set by the writer once it will write no more.
+    std::atomic<uint32_t> closed;
+
+    alignas(64) kj::byte data[RING_SIZE];
+};
+
+enum Side {
+    CLIENT = 0,
+    SERVER = 1
+};
+
+struct SharedRegion {
+    // rings[side] carries the bytes written by that side.  The memfd starts
+    // out zero-filled, which is a valid empty state for both rings.
+    Ring rings[2];
+};
+
+enum Doorbell {
+    DATA_READY = 0,  // Rung by a ring's writer to wake its reader.
+    SPACE_READY = 1, // Rung by a ring's reader to wake its writer.
+};
+
+const int DOORBELL_COUNT = 4;
+
+int doorbellIndex(int ring, Doorbell doorbell) {
+    return ring * 2 + doorbell;
+}
+
+struct ShmConnection {
+    // The descriptors making up one connection, as handed from the server to
+    // the client.
+    kj::AutoCloseFd socket;
+    kj::AutoCloseFd region;
+    kj::AutoCloseFd doorbells[DOORBELL_COUNT];
+};
+
+inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+void ringDoorbell(int doorbell) {
+    uint64_t one = 1;
+    ssize_t n;
+    KJ_NONBLOCKING_SYSCALL(n = ::write(doorbell, &one, sizeof(one)));
+}
+
+void drain(int doorbell) {
+    uint64_t count;
+    ssize_t n;
+    KJ_NONBLOCKING_SYSCALL(n = ::read(doorbell, &count, sizeof(count)));
+}
+
+SharedRegion* mapRegion(int fd) {
+    void* region = ::mmap(nullptr, sizeof(SharedRegion), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (region == MAP_FAILED) {
+        KJ_FAIL_SYSCALL("mmap", errno);
+    }
+    return reinterpret_cast<SharedRegion*>(region);
+}
+
+class ShmStream final : public kj::AsyncIoStream {
+    // One end of a shared-memory connection.
+
+public:
+    ShmStream(kj::UnixEventPort& eventPort, ShmConnection connection, Side side)
+        : socket(kj::mv(connection.socket)),
+          region(mapRegion(connection.region)),
+          side(side),
+          in(region->rings[1 - side]),
+          out(region->rings[side]),
+          inDataReady(kj::mv(connection.doorbells[doorbellIndex(1 - side, DATA_READY)])),
+          inSpaceReady(kj::mv(connection.doorbells[doorbellIndex(1 - side, SPACE_READY)])),
+          outDataReady(kj::mv(connection.doorbells[doorbellIndex(side, DATA_READY)])),
+          outSpaceReady(kj::mv(connection.doorbells[doorbellIndex(side, SPACE_READY)])),
+          inDataObserver(eventPort, inDataReady, kj::UnixEventPort::FdObserver::OBSERVE_READ),
+          outSpaceObserver(eventPort, outSpaceReady, kj::UnixEventPort::FdObserver::OBSERVE_READ),
+          socketObserver(eventPort, socket, kj::UnixEventPort::FdObserver::OBSERVE_READ),
+          peerGone(socketObserver.whenBecomesReadable().then([this]() { peerClosed = true; }).fork()) {}
+
+    ~ShmStream() noexcept(false) {
+        shutdownWrite();
+        ::munmap(region, sizeof(SharedRegion));
+    }
+
+    kj::Promise<size_t> tryRead(void* buffer, size_t minBytes, size_t maxBytes) override {
+        return tryReadInternal(reinterpret_cast<kj::byte*>(buffer), minBytes, maxBytes, 0);
+    }
+
+    kj::Promise<void> write(const void* buffer, size_t size) override {
+        auto bytes = reinterpret_cast<const kj::byte*>(buffer);
+        size_t written = push(bytes, size);
+
+        if (broken) {
+            return corrupted();
+        }
+        if (written == size) {
+            return kj::READY_NOW;
+        }
+        return writeInternal(bytes + written, size - written);
+    }
+
+    kj::Promise<void> write(kj::ArrayPtr<const kj::ArrayPtr<const kj::byte>> pieces) override {
+        for (size_t i = 0; i < pieces.size(); i++) {
+            auto piece = pieces[i];
+            size_t written = push(piece.begin(), piece.size());
+
+            if (broken) {
+                return corrupted();
+            }
+            if (written < piece.size()) {
+                auto rest = pieces.slice(i + 1, pieces.size());
+                return writeInternal(piece.begin() + written, piece.size() - written).then([this, rest]() {
+                    return write(rest);
+                });
+            }
+        }
+        return kj::READY_NOW;
+    }
+
+    void shutdownWrite() override {
+        if (out.closed.exchange(1) == 0) {
+            wakeReader();
+        }
+    }
+
+private:
+    kj::Promise<size_t> tryReadInternal(kj::byte* buffer, size_t minBytes, size_t maxBytes, size_t alreadyRead) {
+        alreadyRead += pull(buffer + alreadyRead, maxBytes - alreadyRead);
+
+        if (broken) {
+            return corrupted();
+        }
+        if (alreadyRead >= minBytes) {
+            return alreadyRead;
+        }
+        if (in.closed.load()) {
+            // The writer published everything before closing.
+            alreadyRead += pull(buffer + alreadyRead, maxBytes - alreadyRead);
+            if (broken) {
+                return corrupted();
+            }
+            return alreadyRead;
+        }
+
+        if (side == CLIENT) {
+            return spin(buffer, minBytes, maxBytes, alreadyRead, std::chrono::steady_clock::now() + SPIN_TIME);
+        }
+        return sleep(buffer, minBytes, maxBytes, alreadyRead);
+    }
+
+    kj::Promise<size_t> spin(kj::byte* buffer, size_t minBytes, size_t maxBytes, size_t alreadyRead,
+                             std::chrono::steady_clock::time_point deadline) {
+        // Polls the ring a few times, then yields to the rest of the event loop
+        // and comes back, until something arrives or the deadline passes.
+        for (int polls = 0; polls < SPIN_POLLS_PER_TURN; polls++) {
+            if (in.tail.load() != in.head.load() || in.closed.load()) {
+                return tryReadInternal(buffer, minBytes, maxBytes, alreadyRead);
+            }
+            cpuRelax();
+        }
+
+        if (std::chrono::steady_clock::now() >= deadline) {
+            return sleep(buffer, minBytes, maxBytes, alreadyRead);
+        }
+        return kj::evalLater([this, buffer, minBytes, maxBytes, alreadyRead, deadline]() {
+            return spin(buffer, minBytes, maxBytes, alreadyRead, deadline);
+        });
+    }
+
+    kj::Promise<size_t> sleep(kj::byte* buffer, size_t minBytes, size_t maxBytes, size_t alreadyRead) {
+        // Announce that we are going to sleep, then check once more in case
+        // the writer published before it could see the announcement.
+        in.readerWaiting.store(1);
+        if (in.tail.load() != in.head.load() || in.closed.load()) {
+            in.readerWaiting.store(0);
+            return tryReadInternal(buffer, minBytes, maxBytes, alreadyRead);
+        }
+        if (peerClosed) {
+            in.readerWaiting.store(0);
+            return alreadyRead;
+        }
+
+        return inDataObserver.whenBecomesReadable().exclusiveJoin(peerGone.addBranch()).then([this, buffer, minBytes, maxBytes, alreadyRead]() {
+            in.readerWaiting.store(0);
+            drain(inDataReady);
+            return tryReadInternal(buffer, minBytes, maxBytes, alreadyRead);
+        });
+    }
+
+    kj::Promise<void> writeInternal(const kj::byte* buffer, size_t size) {
+        // The ring is full.  Writers do not spin: a full ring means the reader
+        // is far behind, not about to catch up.
+        out.writerWaiting.store(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        size_t written = push(buffer, size);
+        if (broken) {
+            out.writerWaiting.store(0);
+            return corrupted();
+        }
+        if (written > 0) {
+            out.writerWaiting.store(0);
+            if (written == size) {
+                return kj::READY_NOW;
+            }
+            return writeInternal(buffer + written, size - written);
+        }
+        if (peerClosed) {
+            out.writerWaiting.store(0);
+            return kj::Exception(kj::Exception::Type::DISCONNECTED, __FILE__, __LINE__,
+                                 kj::heapString("shared-memory peer disconnected"));
+        }
+
+        return outSpaceObserver.whenBecomesReadable().exclusiveJoin(peerGone.addBranch()).then([this, buffer, size]() {
+            out.writerWaiting.store(0);
+            drain(outSpaceReady);
+            return writeInternal(buffer, size);
+        });
+    }
+
+    size_t pull(kj::byte* buffer, size_t size) {
+        // Copies up to `size` bytes out of the incoming ring.
+        uint64_t head = in.head.load(std::memory_order_relaxed);
+        uint64_t tail = in.tail.load(std::memory_order_acquire);
+        if (tail - head > RING_SIZE) {
+            // Both counters live in memory the peer can write to, so do not
+            // trust them to stay within the ring.
+            broken = true;
+            return 0;
+        }
+        size_t n = std::min<uint64_t>(tail - head, size);
+
+        if (n == 0) {
+            return 0;
+        }
+
+        size_t offset = head & (RING_SIZE - 1);
+        size_t first = std::min(n, RING_SIZE - offset);
+        memcpy(buffer, in.data + offset, first);
+        memcpy(buffer + first, in.data, n - first);
+
+        in.head.store(head + n);
+        if (in.writerWaiting.load() && in.writerWaiting.exchange(0)) {
+            ringDoorbell(inSpaceReady);
+        }
+        return n;
+    }
+
+    size_t push(const kj::byte* buffer, size_t size) {
+        // Copies up to `size` bytes into the outgoing ring.
+        uint64_t tail = out.tail.load(std::memory_order_relaxed);
+        uint64_t head = out.head.load(std::memory_order_acquire);
+        if (tail - head > RING_SIZE) {
+            broken = true;
+            return 0;
+        }
+        size_t n = std::min<uint64_t>(RING_SIZE - (tail - head), size);
+
+        if (n == 0) {
+            return 0;
+        }
+
+        size_t offset = tail & (RING_SIZE - 1);
+        size_t first = std::min(n, RING_SIZE - offset);
+        memcpy(out.data + offset, buffer, first);
+        memcpy(out.data, buffer + first, n - first);
+
+        out.tail.store(tail + n);
+        wakeReader();
+        return n;
+    }
+
+    void wakeReader() {
+        if (out.readerWaiting.load() && out.readerWaiting.exchange(0)) {
+            ringDoorbell(outDataReady);
+        }
+    }
+
+    kj::Exception corrupted() {
+        return kj::Exception(kj::Exception::Type::DISCONNECTED, __FILE__, __LINE__,
+                             kj::heapString("shared-memory peer corrupted the ring"));
+    }
+
+    kj::AutoCloseFd socket;
+    SharedRegion* region;
+    Side side;
+    Ring& in;
+    Ring& out;
+
+    kj::AutoCloseFd inDataReady;
+    kj::AutoCloseFd inSpaceReady;
+    kj::AutoCloseFd outDataReady;
+    kj::AutoCloseFd outSpaceReady;
+
+    kj::UnixEventPort::FdObserver inDataObserver;
+    kj::UnixEventPort::FdObserver outSpaceObserver;
+    kj::UnixEventPort::FdObserver socketObserver;
+
+    // Set once the peer has left a ring in an impossible state.  The stream
+    // fails every operation from then on.
+    bool broken = false;
+
+    // Nothing is ever sent over the socket after the handshake, so it only
+    // becomes readable once the peer has closed it.  Watched from the start,
+    // so that checking for a dead peer costs no system call.
+    bool peerClosed = false;
+    kj::ForkedPromise<void> peerGone;
+};
+
+sockaddr_un unixAddress(kj::StringPtr path) {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    KJ_REQUIRE(path.size() < sizeof(addr.sun_path), "socket path too long", path);
+    memcpy(addr.sun_path, path.begin(), path.size());
+    return addr;
+}
+
+void sendDescriptors(ShmConnection& connection) {
+    int fds[1 + DOORBELL_COUNT];
+    fds[0] = connection.region;
+    for (int i = 0; i < DOORBELL_COUNT; i++) {
+        fds[1 + i] = connection.doorbells[i];
+    }
+
+    char payload = 0;
+    iovec iov = {&payload, 1};
+
+    union {
+        char buffer[CMSG_SPACE(sizeof(fds))];
+        cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    KJ_SYSCALL(::sendmsg(connection.socket, &msg, MSG_NOSIGNAL));
+}
+
+void receiveDescriptors(ShmConnection& connection) {
+    int fds[1 + DOORBELL_COUNT];
+
+    char payload;
+    iovec iov = {&payload, 1};
+
+    union {
+        char buffer[CMSG_SPACE(sizeof(fds))];
+        cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+
+    ssize_t n;
+    KJ_SYSCALL(n = ::recvmsg(connection.socket, &msg, MSG_CMSG_CLOEXEC));
+
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    KJ_REQUIRE(n == 1 && cmsg != nullptr && cmsg->cmsg_level == SOL_SOCKET &&
+                   cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len == CMSG_LEN(sizeof(fds)),
+               "malformed shared-memory handshake");
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+    connection.region = kj::AutoCloseFd(fds[0]);
+    for (int i = 0; i < DOORBELL_COUNT; i++) {
+        connection.doorbells[i] = kj::AutoCloseFd(fds[1 + i]);
+    }
+}
+
+kj::Own<kj::AsyncIoStream> serverHandshake(kj::UnixEventPort& eventPort, kj::AutoCloseFd socket) {
+    ShmConnection connection;
+    connection.socket = kj::mv(socket);
+
+    int fd;
+    KJ_SYSCALL(fd = memfd_create("blogstore-shm", MFD_CLOEXEC));
+    connection.region = kj::AutoCloseFd(fd);
+    KJ_SYSCALL(::ftruncate(connection.region, sizeof(SharedRegion)));
+
+    for (auto& doorbell : connection.doorbells) {
+        KJ_SYSCALL(fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+        doorbell = kj::AutoCloseFd(fd);
+    }
+
+    sendDescriptors(connection);
+    return kj::heap<ShmStream>(eventPort, kj::mv(connection), SERVER);
+}
+
+class ShmConnectionReceiver final : public kj::ConnectionReceiver {
+    // Accepts clients on the rendezvous socket and sets up their rings.
+
+public:
+    ShmConnectionReceiver(kj::UnixEventPort& eventPort, kj::AutoCloseFd fd)
+        : eventPort(eventPort),
+          fd(kj::mv(fd)),
+          observer(eventPort, this->fd, kj::UnixEventPort::FdObserver::OBSERVE_READ) {}
+
+    kj::Promise<kj::Own<kj::AsyncIoStream>> accept() override {
+        int socket = ::accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (socket < 0) {
+            int error = errno;
+            if (error == EAGAIN || error == EWOULDBLOCK) {
+                return observer.whenBecomesReadable().then([this]() {
+                    return accept();
+                });
+            }
+            if (error == EINTR || error == ECONNABORTED || error == EPROTO) {
+                // The client went away before we got to it.
+                return accept();
+            }
+            KJ_FAIL_SYSCALL("accept4", error);
+        }
+
+        // A client that misbehaves, or runs into our descriptor limits, only
+        // loses its own connection; its socket is closed along with the rest.
+        kj::Own<kj::AsyncIoStream> stream;
+        KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+                        stream = serverHandshake(eventPort, kj::AutoCloseFd(socket));
+                    })) {
+            KJ_LOG(WARNING, "shared-memory handshake failed", *exception);
+            return kj::evalLater([this]() {
+                return accept();
+            });
+        }
+        return kj::mv(stream);
+    }
+
+    uint getPort() override {
+        return 0;
+    }
+
+private:
+    kj::UnixEventPort& eventPort;
+    kj::AutoCloseFd fd;
+    kj::UnixEventPort::FdObserver observer;
+};
+
+} // namespace
+
+kj::Own<kj::ConnectionReceiver> listenShm(kj::UnixEventPort& eventPort, kj::StringPtr path) {
+    int fd;
+    KJ_SYSCALL(fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0));
+    kj::AutoCloseFd listener(fd);
+
+    auto addr = unixAddress(path);
+    KJ_SYSCALL(::bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)), path);
+    KJ_SYSCALL(::listen(listener, SOMAXCONN));
+
+    return kj::heap<ShmConnectionReceiver>(eventPort, kj::mv(listener));
+}
+
+kj::Own<kj::AsyncIoStream> connectShm(kj::UnixEventPort& eventPort, kj::StringPtr path) {
+    ShmConnection connection;
+
+    // The handshake is blocking: the server answers as soon as it accepts.
+    int fd;
+    KJ_SYSCALL(fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+    connection.socket = kj::AutoCloseFd(fd);
+
+    auto addr = unixAddress(path);
+    KJ_SYSCALL(::connect(connection.socket, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)), path);
+
+    receiveDescriptors(connection);
+    return kj::heap<ShmStream>(eventPort, kj::mv(connection), CLIENT);
+}
+
+#else // __linux__
+
+kj::Own<kj::ConnectionReceiver> listenShm(kj::UnixEventPort&, kj::StringPtr) {
+    KJ_FAIL_REQUIRE("the shared-memory transport is only available on Linux");
+}
+
+kj::Own<kj::AsyncIoStream> connectShm(kj::UnixEventPort&, kj::StringPtr) {
+    KJ_FAIL_REQUIRE("the shared-memory transport is only available on Linux");
+}
+
+#endif // __linux__
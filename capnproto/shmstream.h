@@ -0,0 +1,44 @@
+// Copyright (c) 2018 Pengfei Zhang <zpfalpc23@gmail.com>
+
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the
+// "Software"), to deal in the Software without restriction, including
+// without limitation the rights to use, copy, modify, merge, publish,
+// distribute, sublicense, and/or sell copies of the Software, and to
+// permit persons to whom the Software is furnished to do so, subject to
+// the following conditions:
+
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+// LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+// OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+// WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#ifndef SHMSTREAM_H
+#define SHMSTREAM_H
+
+// Shared-memory transport for clients running on the same host as the server.
+//
+// Each connection gets a memfd holding one ring buffer per direction, plus an
+// eventfd "doorbell" per ring and direction that is only rung when the other
+// side has gone to sleep.  A unix domain socket at the given path is used to
+// hand these descriptors to the client, and afterwards only to notice that the
+// peer has gone away.  Linux only.
+
+#include <kj/async-io.h>
+#include <kj/async-unix.h>
+
+#define SHM_PREFIX "shm:"
+
+// Listens on the unix domain socket at `path`, which must not exist yet.
+kj::Own<kj::ConnectionReceiver> listenShm(kj::UnixEventPort& eventPort, kj::StringPtr path);
+
+// Connects to a server listening with listenShm().
+kj::Own<kj::AsyncIoStream> connectShm(kj::UnixEventPort& eventPort, kj::StringPtr path);
+
+#endif // SHMSTREAM_H
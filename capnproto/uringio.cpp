@@ -0,0 +1,813 @@
+// Copyright (c) 2018 Pengfei Zhang <zpfalpc23@gmail.com>
+
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the
+// "Software"), to deal in the Software without restriction, including
+// without limitation the rights to use, copy, modify, merge, publish,
+// distribute, sublicense, and/or sell copies of the Software, and to
+// permit persons to whom the Software is furnished to do so, subject to
+// the following conditions:
+
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+// LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+// OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+// WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#include "uringio.h"
+#include <kj/debug.h>
+
+#ifdef BLOGSTORE_IO_URING
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <deque>
+#include <set>
+#include <errno.h>
+#include <iostream>
+#include <liburing.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <string.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+const unsigned RING_ENTRIES = 4096;
+
+// Buffers the kernel picks from for multishot receives, shared by all the
+// connections.  A connection holds on to a buffer until its contents have been
+// read, so many small buffers go further than a few large ones when there are
+// many connections.  Messages larger than a buffer simply span several.
+const size_t RECEIVE_BUFFER_SIZE = 4096;
+const int RECEIVE_GROUP = 0;
+
+// How often the number of receives that ran out of buffers is reported.
+const kj::Duration STALL_REPORT_INTERVAL = 1 * kj::SECONDS;
+
+// Registered buffers that outgoing messages are copied into.  Larger messages
+// go through a heap copy and a plain send instead.
+const unsigned SEND_BUFFER_COUNT = 256;
+const size_t SEND_BUFFER_SIZE = 65536;
+
+kj::Exception disconnected(const char* operation, int error) {
+    return kj::Exception(kj::Exception::Type::DISCONNECTED, __FILE__, __LINE__,
+                         kj::str(operation, ": ", strerror(error)));
+}
+
+kj::TimePoint readClock() {
+    timespec ts;
+    KJ_SYSCALL(clock_gettime(CLOCK_MONOTONIC, &ts));
+    return kj::origin<kj::TimePoint>() + ts.tv_sec * kj::SECONDS + ts.tv_nsec * kj::NANOSECONDS;
+}
+
+class Operation {
+    // A submission to the ring.  Its address is the user data of its queue
+    // entries, so that completions find their way back to it.  Multishot
+    // submissions complete several times.
+
+public:
+    virtual ~Operation() noexcept(false) {}
+
+    virtual void complete(int result, unsigned flags) = 0;
+};
+
+class UringStream;
+
+class UringEventPort final : public kj::EventPort {
+public:
+    UringEventPort(unsigned receiveBufferCount)
+        : timer(readClock()),
+          nextStallReport(timer.now() + STALL_REPORT_INTERVAL),
+          receiveBufferCount(receiveBufferCount),
+          receiveMemory(kj::heapArray<kj::byte>(receiveBufferCount * RECEIVE_BUFFER_SIZE)),
+          sendMemory(kj::heapArray<kj::byte>(SEND_BUFFER_COUNT * SEND_BUFFER_SIZE)) {
+        // Writes to a closed connection must fail with EPIPE rather than kill
+        // the server.
+        signal(SIGPIPE, SIG_IGN);
+
+        int error = io_uring_queue_init(RING_ENTRIES, &ring, 0);
+        if (error < 0) {
+            KJ_FAIL_SYSCALL("io_uring_queue_init", -error);
+        }
+
+        receiveRing = io_uring_setup_buf_ring(&ring, receiveBufferCount, RECEIVE_GROUP, 0, &error);
+        if (receiveRing == nullptr) {
+            KJ_FAIL_SYSCALL("io_uring_setup_buf_ring", -error);
+        }
+        for (unsigned id = 0; id < receiveBufferCount; id++) {
+            io_uring_buf_ring_add(receiveRing, receiveBuffer(id).begin(), RECEIVE_BUFFER_SIZE, id,
+                                  io_uring_buf_ring_mask(receiveBufferCount), id);
+        }
+        io_uring_buf_ring_advance(receiveRing, receiveBufferCount);
+
+        std::vector<iovec> iovecs(SEND_BUFFER_COUNT);
+        for (unsigned index = 0; index < SEND_BUFFER_COUNT; index++) {
+            iovecs[index].iov_base = sendBuffer(index).begin();
+            iovecs[index].iov_len = SEND_BUFFER_SIZE;
+            freeSendBuffers.push_back(index);
+        }
+        error = io_uring_register_buffers(&ring, iovecs.data(), iovecs.size());
+        if (error < 0) {
+            KJ_FAIL_SYSCALL("io_uring_register_buffers", -error);
+        }
+    }
+
+    ~UringEventPort() noexcept(false) {
+        io_uring_free_buf_ring(&ring, receiveRing, receiveBufferCount, RECEIVE_GROUP);
+        io_uring_queue_exit(&ring);
+    }
+
+    io_uring_sqe* nextEntry() {
+        // Entries pile up until the event loop runs out of work, and are then
+        // submitted together by wait() or poll().
+        io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+        if (sqe == nullptr) {
+            // The submission queue is full, so flush this batch early.
+            io_uring_submit(&ring);
+            sqe = io_uring_get_sqe(&ring);
+            KJ_ASSERT(sqe != nullptr);
+        }
+        return sqe;
+    }
+
+    void cancel(Operation* operation) {
+        io_uring_sqe* sqe = nextEntry();
+        io_uring_prep_cancel64(sqe, reinterpret_cast<uint64_t>(operation), 0);
+        io_uring_sqe_set_data(sqe, nullptr);
+    }
+
+    kj::ArrayPtr<kj::byte> receiveBuffer(unsigned id) {
+        return receiveMemory.slice(id * RECEIVE_BUFFER_SIZE, (id + 1) * RECEIVE_BUFFER_SIZE);
+    }
+
+    void recycleReceiveBuffer(unsigned id) {
+        io_uring_buf_ring_add(receiveRing, receiveBuffer(id).begin(), RECEIVE_BUFFER_SIZE, id,
+                              io_uring_buf_ring_mask(receiveBufferCount), 0);
+        io_uring_buf_ring_advance(receiveRing, 1);
+
+        if (!stalledStreams.empty()) {
+            resumeStalledStream();
+        }
+    }
+
+    void receiveStalled(UringStream* stream) {
+        // The multishot receive of `stream` found no free buffer.  Arming it
+        // again right away would only fail the same way, so it waits until a
+        // buffer is recycled.
+        stalledStreams.insert(stream);
+        receiveStalls++;
+    }
+
+    void forgetStalled(UringStream* stream) {
+        stalledStreams.erase(stream);
+    }
+
+    kj::ArrayPtr<kj::byte> sendBuffer(unsigned index) {
+        return sendMemory.slice(index * SEND_BUFFER_SIZE, (index + 1) * SEND_BUFFER_SIZE);
+    }
+
+    kj::Maybe<unsigned> acquireSendBuffer() {
+        if (freeSendBuffers.empty()) {
+            return nullptr;
+        }
+        unsigned index = freeSendBuffers.back();
+        freeSendBuffers.pop_back();
+        return index;
+    }
+
+    void releaseSendBuffer(unsigned index) {
+        freeSendBuffers.push_back(index);
+    }
+
+    kj::Timer& getTimer() {
+        return timer;
+    }
+
+    bool wait() override {
+        // Sleep no longer than until the next timer event.
+        __kernel_timespec timeout;
+        __kernel_timespec* timeoutPtr = nullptr;
+        KJ_IF_MAYBE(next, timer.nextEvent()) {
+            kj::TimePoint now = readClock();
+            int64_t nanos = *next > now ? (*next - now) / kj::NANOSECONDS : 0;
+            timeout.tv_sec = nanos / 1000000000;
+            timeout.tv_nsec = nanos % 1000000000;
+            timeoutPtr = &timeout;
+        }
+
+        io_uring_cqe* cqe;
+        int result = io_uring_submit_and_wait_timeout(&ring, &cqe, 1, timeoutPtr, nullptr);
+        if (result < 0 && result != -EINTR && result != -ETIME) {
+            KJ_FAIL_SYSCALL("io_uring_submit_and_wait_timeout", -result);
+        }
+        dispatch();
+        timer.advanceTo(readClock());
+        reportStalls();
+        return false;
+    }
+
+    bool poll() override {
+        int result = io_uring_submit(&ring);
+        if (result < 0 && result != -EINTR) {
+            KJ_FAIL_SYSCALL("io_uring_submit", -result);
+        }
+        dispatch();
+        timer.advanceTo(readClock());
+        return false;
+    }
+
+private:
+    void resumeStalledStream();
+
+    void reportStalls() {
+        // Tells the operator when the receive buffers are too few for the
+        // load, at most once per interval.
+        if (timer.now() < nextStallReport) {
+            return;
+        }
+        nextStallReport = timer.now() + STALL_REPORT_INTERVAL;
+
+        if (receiveStalls != reportedStalls) {
+            std::cerr << "io_uring: " << receiveStalls - reportedStalls
+                      << " receives waited for a free buffer (" << receiveStalls
+                      << " in total); consider more than " << receiveBufferCount
+                      << " receive buffers." << std::endl;
+            reportedStalls = receiveStalls;
+        }
+    }
+
+    void dispatch() {
+        io_uring_cqe* cqe;
+        unsigned head;
+        unsigned count = 0;
+
+        io_uring_for_each_cqe(&ring, head, cqe) {
+            count++;
+
+            // Cancelations carry no operation.
+            auto operation = reinterpret_cast<Operation*>(io_uring_cqe_get_data(cqe));
+            if (operation != nullptr) {
+                operation->complete(cqe->res, cqe->flags);
+            }
+        }
+        io_uring_cq_advance(&ring, count);
+    }
+
+    io_uring ring;
+    kj::TimerImpl timer;
+    kj::TimePoint nextStallReport;
+    unsigned receiveBufferCount;
+    uint64_t receiveStalls = 0;
+    uint64_t reportedStalls = 0;
+
+    // Streams whose receive is waiting for a buffer to come back.
+    std::set<UringStream*> stalledStreams;
+    io_uring_buf_ring* receiveRing;
+    kj::Array<kj::byte> receiveMemory;
+    kj::Array<kj::byte> sendMemory;
+    std::vector<unsigned> freeSendBuffers;
+};
+
+template <typename Owner>
+class OwnedOperation : public Operation {
+    // An operation issued on behalf of an object that may go away while it is
+    // still in flight.  In that case the operation is canceled, and deletes
+    // itself once its last completion has arrived.
+
+public:
+    OwnedOperation(UringEventPort& port, Owner& owner)
+        : port(port), owner(&owner) {}
+
+    void orphan() {
+        if (inFlight) {
+            owner = nullptr;
+            port.cancel(this);
+        } else {
+            delete this;
+        }
+    }
+
+    bool isInFlight() const {
+        return inFlight;
+    }
+
+protected:
+    UringEventPort& port;
+    Owner* owner;
+    bool inFlight = false;
+};
+
+class UringStream;
+
+class Receive final : public OwnedOperation<UringStream> {
+    // The multishot receive a stream keeps armed.
+
+public:
+    using OwnedOperation::OwnedOperation;
+
+    void start(int fd);
+    void complete(int result, unsigned flags) override;
+};
+
+class Send final : public OwnedOperation<UringStream> {
+    // The one write a stream may have in flight.
+
+public:
+    using OwnedOperation::OwnedOperation;
+
+    kj::Promise<void> start(int fd, kj::ArrayPtr<const kj::ArrayPtr<const kj::byte>> pieces);
+    void complete(int result, unsigned flags) override;
+
+private:
+    void submit();
+    void release();
+
+    int fd = -1;
+    kj::Maybe<unsigned> bufferIndex;
+    kj::Array<kj::byte> overflow;
+    const kj::byte* data = nullptr;
+    size_t remaining = 0;
+    kj::Own<kj::PromiseFulfiller<void>> fulfiller;
+};
+
+class UringStream final : public kj::AsyncIoStream {
+public:
+    UringStream(UringEventPort& port, kj::AutoCloseFd fd)
+        : port(port),
+          fd(kj::mv(fd)),
+          receive(new Receive(port, *this)),
+          send(new Send(port, *this)) {}
+
+    ~UringStream() noexcept(false) {
+        port.forgetStalled(this);
+        receive->orphan();
+        send->orphan();
+        for (auto& chunk : chunks) {
+            port.recycleReceiveBuffer(chunk.id);
+        }
+    }
+
+    kj::Promise<size_t> tryRead(void* buffer, size_t minBytes, size_t maxBytes) override {
+        return tryReadInternal(reinterpret_cast<kj::byte*>(buffer), minBytes, maxBytes, 0);
+    }
+
+    kj::Promise<void> write(const void* buffer, size_t size) override {
+        kj::ArrayPtr<const kj::byte> piece(reinterpret_cast<const kj::byte*>(buffer), size);
+        return write(kj::arrayPtr(&piece, 1));
+    }
+
+    kj::Promise<void> write(kj::ArrayPtr<const kj::ArrayPtr<const kj::byte>> pieces) override {
+        return send->start(fd, pieces);
+    }
+
+    void shutdownWrite() override {
+        KJ_SYSCALL(::shutdown(fd, SHUT_WR));
+    }
+
+    void received(unsigned id, size_t size) {
+        chunks.push_back({id, 0, size});
+        wakeReader();
+    }
+
+    void receiveEnded(int result) {
+        // A multishot receive stops at the end of the stream, on errors, and
+        // when the shared buffers ran out; the last case is resumed by the
+        // event port once a buffer is recycled.
+        receiving = false;
+        if (result == -ENOBUFS) {
+            stalled = true;
+            port.receiveStalled(this);
+            return;
+        }
+        if (result == 0) {
+            atEnd = true;
+        } else if (result < 0 && result != -ECANCELED) {
+            error = -result;
+        }
+        wakeReader();
+    }
+
+    void resumeReceive() {
+        stalled = false;
+        if (!receiving && !atEnd && error == 0) {
+            receive->start(fd);
+            receiving = true;
+        }
+    }
+
+private:
+    struct Chunk {
+        unsigned id;
+        size_t offset;
+        size_t size;
+    };
+
+    kj::Promise<size_t> tryReadInternal(kj::byte* buffer, size_t minBytes, size_t maxBytes, size_t alreadyRead) {
+        while (alreadyRead < maxBytes && !chunks.empty()) {
+            auto& chunk = chunks.front();
+            size_t n = std::min(chunk.size - chunk.offset, maxBytes - alreadyRead);
+            memcpy(buffer + alreadyRead, port.receiveBuffer(chunk.id).begin() + chunk.offset, n);
+            chunk.offset += n;
+            alreadyRead += n;
+
+            if (chunk.offset == chunk.size) {
+                port.recycleReceiveBuffer(chunk.id);
+                chunks.pop_front();
+            }
+        }
+
+        if (alreadyRead >= minBytes || atEnd) {
+            return alreadyRead;
+        }
+        if (error != 0) {
+            return disconnected("recv", error);
+        }
+        if (!receiving && !stalled) {
+            receive->start(fd);
+            receiving = true;
+        }
+
+        auto paf = kj::newPromiseAndFulfiller<void>();
+        readFulfiller = kj::mv(paf.fulfiller);
+        return paf.promise.then([this, buffer, minBytes, maxBytes, alreadyRead]() {
+            return tryReadInternal(buffer, minBytes, maxBytes, alreadyRead);
+        });
+    }
+
+    void wakeReader() {
+        KJ_IF_MAYBE(fulfiller, readFulfiller) {
+            (*fulfiller)->fulfill();
+            readFulfiller = nullptr;
+        }
+    }
+
+    UringEventPort& port;
+    kj::AutoCloseFd fd;
+    Receive* receive;
+    Send* send;
+
+    // Received data not read yet, in buffers still held from the kernel.
+    std::deque<Chunk> chunks;
+    bool receiving = false;
+    bool stalled = false;
+    bool atEnd = false;
+    int error = 0;
+    kj::Maybe<kj::Own<kj::PromiseFulfiller<void>>> readFulfiller;
+};
+
+void UringEventPort::resumeStalledStream() {
+    // One buffer came back, so one stream gets to try again.
+    auto first = stalledStreams.begin();
+    UringStream* stream = *first;
+    stalledStreams.erase(first);
+    stream->resumeReceive();
+}
+
+void Receive::start(int fd) {
+    io_uring_sqe* sqe = port.nextEntry();
+    io_uring_prep_recv_multishot(sqe, fd, nullptr, 0, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RECEIVE_GROUP;
+    io_uring_sqe_set_data(sqe, this);
+    inFlight = true;
+}
+
+void Receive::complete(int result, unsigned flags) {
+    bool more = flags & IORING_CQE_F_MORE;
+    if (!more) {
+        inFlight = false;
+    }
+
+    if (flags & IORING_CQE_F_BUFFER) {
+        unsigned id = flags >> IORING_CQE_BUFFER_SHIFT;
+        if (owner != nullptr && result > 0) {
+            owner->received(id, result);
+        } else {
+            port.recycleReceiveBuffer(id);
+        }
+    }
+
+    if (owner == nullptr) {
+        if (!more) {
+            delete this;
+        }
+    } else if (!more) {
+        owner->receiveEnded(result);
+    }
+}
+
+kj::Promise<void> Send::start(int fd, kj::ArrayPtr<const kj::ArrayPtr<const kj::byte>> pieces) {
+    KJ_REQUIRE(!inFlight, "concurrent write on UringStream");
+
+    size_t size = 0;
+    for (auto& piece : pieces) {
+        size += piece.size();
+    }
+    if (size == 0) {
+        return kj::READY_NOW;
+    }
+
+    // Gather the message into memory we own, so that the kernel never reads
+    // from the caller's buffers after a canceled write.
+    kj::ArrayPtr<kj::byte> target;
+    if (size <= SEND_BUFFER_SIZE) {
+        bufferIndex = port.acquireSendBuffer();
+    }
+    KJ_IF_MAYBE(index, bufferIndex) {
+        target = port.sendBuffer(*index).slice(0, size);
+    } else {
+        overflow = kj::heapArray<kj::byte>(size);
+        target = overflow;
+    }
+
+    kj::byte* position = target.begin();
+    for (auto& piece : pieces) {
+        memcpy(position, piece.begin(), piece.size());
+        position += piece.size();
+    }
+
+    this->fd = fd;
+    data = target.begin();
+    remaining = size;
+
+    auto paf = kj::newPromiseAndFulfiller<void>();
+    fulfiller = kj::mv(paf.fulfiller);
+    submit();
+    return kj::mv(paf.promise);
+}
+
+void Send::submit() {
+    io_uring_sqe* sqe = port.nextEntry();
+    KJ_IF_MAYBE(index, bufferIndex) {
+        io_uring_prep_write_fixed(sqe, fd, data, remaining, 0, *index);
+    } else {
+        io_uring_prep_send(sqe, fd, data, remaining, MSG_NOSIGNAL);
+    }
+    io_uring_sqe_set_data(sqe, this);
+    inFlight = true;
+}
+
+void Send::complete(int result, unsigned flags) {
+    inFlight = false;
+
+    if (owner != nullptr && result > 0 && static_cast<size_t>(result) < remaining) {
+        // Short write, send the rest.
+        data += result;
+        remaining -= result;
+        submit();
+        return;
+    }
+
+    release();
+
+    if (owner == nullptr) {
+        delete this;
+    } else if (result <= 0) {
+        fulfiller->reject(disconnected("send", result < 0 ? -result : EPIPE));
+    } else {
+        fulfiller->fulfill();
+    }
+}
+
+void Send::release() {
+    KJ_IF_MAYBE(index, bufferIndex) {
+        port.releaseSendBuffer(*index);
+        bufferIndex = nullptr;
+    }
+    overflow = nullptr;
+}
+
+class UringConnectionReceiver;
+
+class Accept final : public OwnedOperation<UringConnectionReceiver> {
+    // The multishot accept on the listening socket.
+
+public:
+    using OwnedOperation::OwnedOperation;
+
+    void start(int fd);
+    void complete(int result, unsigned flags) override;
+};
+
+class UringConnectionReceiver final : public kj::ConnectionReceiver {
+public:
+    UringConnectionReceiver(UringEventPort& port, kj::AutoCloseFd fd)
+        : port(port),
+          fd(kj::mv(fd)),
+          acceptOperation(new Accept(port, *this)) {}
+
+    ~UringConnectionReceiver() noexcept(false) {
+        acceptOperation->orphan();
+        for (int connection : pending) {
+            ::close(connection);
+        }
+    }
+
+    kj::Promise<kj::Own<kj::AsyncIoStream>> accept() override {
+        if (!pending.empty()) {
+            int connection = pending.front();
+            pending.pop_front();
+            return kj::Own<kj::AsyncIoStream>(kj::heap<UringStream>(port, kj::AutoCloseFd(connection)));
+        }
+        if (error != 0) {
+            return disconnected("accept", error);
+        }
+        if (!acceptOperation->isInFlight()) {
+            acceptOperation->start(fd);
+        }
+
+        auto paf = kj::newPromiseAndFulfiller<void>();
+        acceptFulfiller = kj::mv(paf.fulfiller);
+        return paf.promise.then([this]() {
+            return accept();
+        });
+    }
+
+    uint getPort() override {
+        sockaddr_storage addr;
+        socklen_t length = sizeof(addr);
+        KJ_SYSCALL(::getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &length));
+
+        switch (addr.ss_family) {
+        case AF_INET:
+            return ntohs(reinterpret_cast<sockaddr_in*>(&addr)->sin_port);
+        case AF_INET6:
+            return ntohs(reinterpret_cast<sockaddr_in6*>(&addr)->sin6_port);
+        default:
+            return 0;
+        }
+    }
+
+    void accepted(int result) {
+        if (result >= 0) {
+            pending.push_back(result);
+        } else if (result != -ECONNABORTED && result != -EINTR && result != -EAGAIN && result != -ECANCELED) {
+            error = -result;
+        }
+
+        KJ_IF_MAYBE(fulfiller, acceptFulfiller) {
+            (*fulfiller)->fulfill();
+            acceptFulfiller = nullptr;
+        }
+    }
+
+private:
+    UringEventPort& port;
+    kj::AutoCloseFd fd;
+    Accept* acceptOperation;
+
+    // Accepted connections not handed out yet.
+    std::deque<int> pending;
+    int error = 0;
+    kj::Maybe<kj::Own<kj::PromiseFulfiller<void>>> acceptFulfiller;
+};
+
+void Accept::start(int fd) {
+    io_uring_sqe* sqe = port.nextEntry();
+    io_uring_prep_multishot_accept(sqe, fd, nullptr, nullptr, SOCK_CLOEXEC);
+    io_uring_sqe_set_data(sqe, this);
+    inFlight = true;
+}
+
+void Accept::complete(int result, unsigned flags) {
+    bool more = flags & IORING_CQE_F_MORE;
+    if (!more) {
+        inFlight = false;
+    }
+
+    if (owner != nullptr) {
+        owner->accepted(result);
+    } else {
+        if (result >= 0) {
+            ::close(result);
+        }
+        if (!more) {
+            delete this;
+        }
+    }
+}
+
+kj::AutoCloseFd bindListener(kj::StringPtr address, uint defaultPort) {
+    // Accepts "unix:/path/to/socket", or "HOST[:PORT]" where HOST may be '*'
+    // and IPv6 addresses are written in brackets.
+    std::string spec = address.cStr();
+    int fd;
+
+    if (spec.compare(0, 5, "unix:") == 0) {
+        std::string path = spec.substr(5);
+
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        KJ_REQUIRE(path.size() < sizeof(addr.sun_path), "socket path too long", address);
+        memcpy(addr.sun_path, path.data(), path.size());
+
+        KJ_SYSCALL(fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+        kj::AutoCloseFd listener(fd);
+        KJ_SYSCALL(::bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)), address);
+        KJ_SYSCALL(::listen(listener, SOMAXCONN));
+        return listener;
+    }
+
+    std::string host = spec;
+    std::string port = std::to_string(defaultPort);
+
+    if (!spec.empty() && spec[0] == '[') {
+        size_t close = spec.find(']');
+        KJ_REQUIRE(close != std::string::npos, "malformed address", address);
+        host = spec.substr(1, close - 1);
+        if (close + 1 < spec.size() && spec[close + 1] == ':') {
+            port = spec.substr(close + 2);
+        }
+    } else {
+        size_t colon = spec.rfind(':');
+        if (colon != std::string::npos) {
+            host = spec.substr(0, colon);
+            port = spec.substr(colon + 1);
+        }
+    }
+
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    addrinfo* result;
+    int error = ::getaddrinfo(host == "*" ? nullptr : host.c_str(), port.c_str(), &hints, &result);
+    KJ_REQUIRE(error == 0, "could not resolve address", address, gai_strerror(error));
+    KJ_DEFER(::freeaddrinfo(result));
+
+    KJ_SYSCALL(fd = ::socket(result->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0));
+    kj::AutoCloseFd listener(fd);
+
+    int reuse = 1;
+    KJ_SYSCALL(::setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)));
+
+    // Nagle's algorithm would hold back the second of two small replies until
+    // the client's delayed ACK, as kj avoids for its own sockets.  Accepted
+    // sockets inherit the option.
+    if (result->ai_family == AF_INET || result->ai_family == AF_INET6) {
+        int noDelay = 1;
+        KJ_SYSCALL(::setsockopt(listener, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay)));
+    }
+
+    KJ_SYSCALL(::bind(listener, result->ai_addr, result->ai_addrlen), address);
+    KJ_SYSCALL(::listen(listener, SOMAXCONN));
+    return listener;
+}
+
+} // namespace
+
+bool uringAvailable() {
+    return true;
+}
+
+kj::Own<kj::EventPort> newUringEventPort(unsigned receiveBuffers) {
+    KJ_REQUIRE(receiveBuffers > 0 && receiveBuffers <= MAX_URING_RECEIVE_BUFFERS
+                   && (receiveBuffers & (receiveBuffers - 1)) == 0,
+               "the number of receive buffers must be a power of two no larger than 32768", receiveBuffers);
+    return kj::heap<UringEventPort>(receiveBuffers);
+}
+
+kj::Timer& getUringTimer(kj::EventPort& eventPort) {
+    return kj::downcast<UringEventPort>(eventPort).getTimer();
+}
+
+kj::Own<kj::ConnectionReceiver> listenUring(kj::EventPort& eventPort, kj::StringPtr address, uint defaultPort) {
+    auto& port = kj::downcast<UringEventPort>(eventPort);
+    return kj::heap<UringConnectionReceiver>(port, bindListener(address, defaultPort));
+}
+
+#else // BLOGSTORE_IO_URING
+
+bool uringAvailable() {
+    return false;
+}
+
+kj::Own<kj::EventPort> newUringEventPort(unsigned) {
+    KJ_FAIL_REQUIRE("io_uring support is not built in; rebuild with `make USE_IO_URING=1`");
+}
+
+kj::Timer& getUringTimer(kj::EventPort&) {
+    KJ_FAIL_REQUIRE("io_uring support is not built in; rebuild with `make USE_IO_URING=1`");
+}
+
+kj::Own<kj::ConnectionReceiver> listenUring(kj::EventPort&, kj::StringPtr, uint) {
+    KJ_FAIL_REQUIRE("io_uring support is not built in; rebuild with `make USE_IO_URING=1`");
+}
+
+#endif // BLOGSTORE_IO_URING
@@ -0,0 +1,63 @@
+// Copyright (c) 2018 Pengfei Zhang <zpfalpc23@gmail.com>
+
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the
+// "Software"), to deal in the Software without restriction, including
+// without limitation the rights to use, copy, modify, merge, publish,
+// distribute, sublicense, and/or sell copies of the Software, and to
+// permit persons to whom the Software is furnished to do so, subject to
+// the following conditions:
+
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+// LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+// OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+// WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#ifndef URINGIO_H
+#define URINGIO_H
+
+// io_uring backend for the server's network I/O, as an alternative to kj's
+// epoll-based UnixEventPort.
+//
+// All the operations issued while the event loop runs are queued and handed
+// to the kernel in one io_uring_enter() once the loop runs out of work, which
+// also waits for the next completions.  Connections are accepted with a single
+// multishot accept, each connection keeps one multishot receive armed that
+// picks buffers from a shared provided-buffer ring, and outgoing messages are
+// copied into registered buffers.
+//
+// Only available when built with `make USE_IO_URING=1`, which needs liburing
+// 2.4 and Linux 6.0 or later; otherwise these functions throw.
+
+#include <kj/async-io.h>
+#include <kj/timer.h>
+
+// Whether the server was built with io_uring support.
+bool uringAvailable();
+
+// Default and largest number of 4 KiB buffers shared by all the connections
+// for receiving.
+#define DEFAULT_URING_RECEIVE_BUFFERS 16384
+#define MAX_URING_RECEIVE_BUFFERS 32768
+
+// Returns an event port to drive a kj::EventLoop with.  `receiveBuffers` must
+// be a power of two no larger than MAX_URING_RECEIVE_BUFFERS.  Receives that
+// find no free buffer are re-armed, and counted in a report written to
+// stderr at most once a second.
+kj::Own<kj::EventPort> newUringEventPort(unsigned receiveBuffers = DEFAULT_URING_RECEIVE_BUFFERS);
+
+// Returns the timer of an event port made by newUringEventPort().
+kj::Timer& getUringTimer(kj::EventPort& eventPort);
+
+// Listens on `address`, in the same format as EzRpcServer takes, with
+// connections served through `eventPort`, which must come from
+// newUringEventPort().
+kj::Own<kj::ConnectionReceiver> listenUring(kj::EventPort& eventPort, kj::StringPtr address, uint defaultPort);
+
+#endif // URINGIO_H